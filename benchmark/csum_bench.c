@@ -0,0 +1,118 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "../block.h"
+
+/*
+ * Block checksum overhead
+ * Part 1 times CRC32C on 4 KiB blocks, with the SSE4.2 instruction when the
+ * CPU has it and with the slice-by-8 tables. Part 2 writes, syncs and reads
+ * back a file on the mounted file system; run it once on a mount with
+ * -o csum=none and once with -o csum=all (or the default csum=meta) and
+ * compare. Every write computes a checksum whatever the mount option.
+ */
+
+/* You need to change this macro to your TFS mount point*/
+#define TESTDIR "/tmp/php51/mountdir"
+
+#define BLOCKSIZE 4096
+#define CRC_ITERS 200000
+#define FILE_BLOCKS 2048			/* 8 MiB */
+
+/* the ioctl from rufs.h, without pulling in the rest of it */
+#define RUFS_IOC_CACHE_STATS	_IOR('R', 3, struct bio_stats)
+
+extern int crc32c_hw;
+
+char buf[BLOCKSIZE];
+
+float time_diff(struct timeval *start, struct timeval *end) {
+	return (end->tv_sec - start->tv_sec) + 1e-6 * (end->tv_usec - start->tv_usec);
+}
+
+static float crc_ns_per_block() {
+	struct timeval start, end;
+	unsigned int crc = 0;
+
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < CRC_ITERS; i++)
+		crc ^= crc32c(0, buf, BLOCKSIZE);
+	gettimeofday(&end, NULL);
+
+	if (crc == 0x12345678)		/* keep the loop */
+		printf(" ");
+	return time_diff(&start, &end) * 1e9 / CRC_ITERS;
+}
+
+int main(int argc, char **argv) {
+
+	struct timeval start, end;
+	int i, fd;
+
+	for (i = 0; i < BLOCKSIZE; i++)
+		buf[i] = rand();
+
+	/* Part 1: CRC32C alone */
+	float hw_ns = crc_ns_per_block();
+	printf("CRC32C %s: %0.1f ns per block, %0.2f GB/s\n", crc32c_impl(), hw_ns, BLOCKSIZE / hw_ns);
+	if (crc32c_hw) {
+		crc32c_hw = 0;
+		float sw_ns = crc_ns_per_block();
+		printf("CRC32C %s: %0.1f ns per block, %0.2f GB/s\n", crc32c_impl(), sw_ns, BLOCKSIZE / sw_ns);
+		crc32c_hw = 1;
+	}
+
+	/* Part 2: write, sync and read back through the file system */
+	if ((fd = open(TESTDIR "/csum_file", O_CREAT | O_TRUNC | O_RDWR, 0666)) < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < FILE_BLOCKS; i++) {
+		if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE) {
+			perror("write");
+			exit(1);
+		}
+	}
+	fsync(fd);
+	gettimeofday(&end, NULL);
+	float wt = time_diff(&start, &end);
+	printf("Write: %0.2f MB/s, %0.1f us per block\n", FILE_BLOCKS * (BLOCKSIZE / 1048576.0) / wt, wt * 1e6 / FILE_BLOCKS);
+
+	close(fd);
+	if ((fd = open(TESTDIR "/csum_file", O_RDONLY)) < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < FILE_BLOCKS; i++) {
+		if (read(fd, buf, BLOCKSIZE) != BLOCKSIZE) {
+			perror("read");
+			exit(1);
+		}
+	}
+	gettimeofday(&end, NULL);
+	float rt = time_diff(&start, &end);
+	printf("Read: %0.2f MB/s, %0.1f us per block\n", FILE_BLOCKS * (BLOCKSIZE / 1048576.0) / rt, rt * 1e6 / FILE_BLOCKS);
+
+	printf("Checksum share of a block write: %0.2f%%\n", 100 * hw_ns / (wt * 1e9 / FILE_BLOCKS));
+
+	struct bio_stats stats;
+	if (ioctl(fd, RUFS_IOC_CACHE_STATS, &stats) == 0)
+		printf("Checksum errors: %lu\n", stats.csum_errors);
+
+	close(fd);
+	unlink(TESTDIR "/csum_file");
+	return 0;
+}
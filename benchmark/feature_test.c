@@ -0,0 +1,795 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/statvfs.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+
+/*
+ * Checks for the features test_case does not cover. Tests that need a
+ * mount option run only when it is named on the command line, e.g.
+ *     ./feature_test dedup compress tailpack
+ * for a file system mounted with -o dedup,compress,tailpack,use_ino
+ * (use_ino gives the st_ino RUFS_IOC_CLONE takes). The others are skipped.
+ * Log mode is checked the same way, by ./feature_test logwrite on a
+ * -o logwrite mount.
+ * The fsync test behaves the same in every durability mode, run it against
+ * a mount with each of durability=strict, batch and unsafe.
+ */
+
+/* From ../rufs.h, whose struct dirent clashes with <dirent.h> */
+struct rufs_dedup_stats {
+	uint64_t	written;
+	uint64_t	shared;
+	uint64_t	entries;
+	uint64_t	index_bytes;
+};
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE	(1 << 0)
+#define RENAME_EXCHANGE		(1 << 1)
+#endif
+
+struct rufs_rename {
+	uint32_t	flags;
+	char		from[1024];
+	char		to[1024];
+};
+
+#define RUFS_IOC_CLONE		_IOW('R', 5, uint64_t)
+#define RUFS_IOC_RENAME		_IOW('R', 7, struct rufs_rename)
+#define RUFS_IOC_DEDUP_STATS	_IOR('R', 8, struct rufs_dedup_stats)
+
+/* You need to change this macro to your TFS mount point*/
+#define TESTDIR "/tmp/php51/mountdir"
+#define SPACE_NAME "/features"		/* scratch directory, from the mount root */
+#define SPACE TESTDIR SPACE_NAME
+
+#define BLOCKSIZE 4096
+#define FSPATHLEN 256
+#define FILEPERM 0666
+#define DIRPERM 0755
+#define N_INODES 1000			/* several times the inodes mkfs lays out */
+#define N_ENTRIES 300
+#define TRUNC_BLOCKS 64
+#define HOLE_AT 1000			/* block written past a hole */
+#define FALLOC_BLOCKS 32
+#define OPEN_BLOCKS 64
+#define SYNC_WRITES 32
+#define LOG_BLOCKS 256
+#define LOG_OVERWRITES 1024
+#define N_COPIES 4
+#define SHARED_BLOCKS 64
+#define PACKED_BLOCKS 256
+#define N_TAILS 64
+#define RECLAIM_WAIT 50		/* tenths of a second to wait for unlinked blocks */
+
+char buf[BLOCKSIZE];
+char cmp[BLOCKSIZE];
+
+float time_diff(struct timeval *start, struct timeval *end) {
+	return (end->tv_sec - start->tv_sec) + 1e-6 * (end->tv_usec - start->tv_usec);
+}
+
+void fail(const char *test, const char *what) {
+	printf("%s: %s failure \n", test, what);
+	exit(1);
+}
+
+long free_inodes() {
+	struct statvfs sv;
+	if (statvfs(TESTDIR, &sv) < 0) {
+		perror("statvfs");
+		exit(1);
+	}
+	return sv.f_ffree;
+}
+
+long free_blocks() {
+	struct statvfs sv;
+	if (statvfs(TESTDIR, &sv) < 0) {
+		perror("statvfs");
+		exit(1);
+	}
+	return sv.f_bfree;
+}
+
+/* Unlinked files are freed in the background; wait for the count to return */
+int wait_free(long want) {
+	for (int i = 0; i < RECLAIM_WAIT; i++) {
+		if (free_blocks() >= want)
+			return 0;
+		usleep(100000);
+	}
+	return -1;
+}
+
+/* Contents of block blk: the same for every file, and random enough that
+ * it does not compress */
+void fill_random(char *b, int blk) {
+	unsigned int seed = blk + 1;
+	for (int k = 0; k < BLOCKSIZE; k++)
+		b[k] = rand_r(&seed);
+}
+
+/* Contents of block blk: text that compresses well, different per block */
+void fill_text(char *b, int blk) {
+	memset(b, 0, BLOCKSIZE);
+	for (int k = 0; k < BLOCKSIZE; k += 64)
+		snprintf(b + k, 64, "block %8d line %4d of a compressible file ........\n", blk, k / 64);
+}
+
+char *space_path(const char *name, int i) {
+	static char path[FSPATHLEN];
+	sprintf(path, "%s/%s%d", SPACE, name, i);
+	return path;
+}
+
+/* Open file name<i> in the scratch directory */
+int open_space(const char *name, int i, int flags) {
+	int fd = open(space_path(name, i), flags, FILEPERM);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+	return fd;
+}
+
+/* Files are created empty up front, so the directory and inode table have
+ * grown before a test takes the free count */
+void create_empty(const char *name, int count) {
+	for (int i = 0; i < count; i++)
+		close(open_space(name, i, O_WRONLY | O_CREAT));
+}
+
+void unlink_space(const char *name, int count) {
+	for (int i = 0; i < count; i++) {
+		if (unlink(space_path(name, i)) < 0) {
+			perror("unlink");
+			exit(1);
+		}
+	}
+}
+
+/* Make file name<i> share every block of src<j> */
+void clone_space(const char *name, int i, const char *src, int j) {
+	struct stat s;
+	int src_fd = open_space(src, j, O_RDONLY);
+	int fd = open_space(name, i, O_WRONLY);
+	fstat(src_fd, &s);
+	uint64_t src_ino = s.st_ino;
+	if (ioctl(fd, RUFS_IOC_CLONE, &src_ino) < 0) {
+		perror("ioctl clone");
+		exit(1);
+	}
+	close(fd);
+	close(src_fd);
+}
+
+/* File name<i> holding len bytes of c */
+void write_space(const char *name, int i, char c, int len) {
+	int fd = open_space(name, i, O_WRONLY | O_CREAT | O_TRUNC);
+	memset(buf, c, len);
+	if (write(fd, buf, len) != len) {
+		perror("write");
+		exit(1);
+	}
+	close(fd);
+}
+
+int space_holds(const char *name, int i, char c, int len) {
+	int fd = open(space_path(name, i), O_RDONLY);
+	if (fd < 0)
+		return 0;
+	memset(cmp, c, len);
+	int ok = read(fd, buf, BLOCKSIZE) == len && memcmp(buf, cmp, len) == 0;
+	close(fd);
+	return ok;
+}
+
+/* Rename from<i> to to<j> like renameat2(2), which FUSE does not pass on */
+int rename_space(const char *from, int i, const char *to, int j, unsigned int flags) {
+	struct rufs_rename rn;
+	rn.flags = flags;
+	snprintf(rn.from, sizeof(rn.from), "%s/%s%d", SPACE_NAME, from, i);
+	snprintf(rn.to, sizeof(rn.to), "%s/%s%d", SPACE_NAME, to, j);
+	int fd = open(SPACE, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+	int ret = ioctl(fd, RUFS_IOC_RENAME, &rn);
+	int err = errno;
+	close(fd);
+	errno = err;
+	return ret;
+}
+
+void dedup_stats(struct rufs_dedup_stats *ds) {
+	int fd = open(SPACE, O_RDONLY);
+	if (fd < 0 || ioctl(fd, RUFS_IOC_DEDUP_STATS, ds) < 0) {
+		perror("ioctl dedup stats");
+		exit(1);
+	}
+	close(fd);
+}
+
+
+/* The inode table grows as files are created, each file keeps its own data */
+void test_inodes() {
+	long before = free_inodes();
+	for (int i = 0; i < N_INODES; i++)
+		write_space("ino", i, 'a' + i % 26, 1 + i % 100);
+	if (before - free_inodes() != N_INODES)
+		fail("inodes", "count");
+	for (int i = 0; i < N_INODES; i++) {
+		if (!space_holds("ino", i, 'a' + i % 26, 1 + i % 100))
+			fail("inodes", "read");
+	}
+
+	unlink_space("ino", N_INODES);
+	for (int i = 0; i < RECLAIM_WAIT && free_inodes() < before; i++)
+		usleep(100000);
+	if (free_inodes() < before)
+		fail("inodes", "unlink");
+}
+
+
+/* Next name<i> in a listing, skipping anything else; -1 at the end */
+int next_entry(DIR *dir, const char *name) {
+	struct dirent *de;
+	size_t len = strlen(name);
+	while ((de = readdir(dir)) != NULL) {
+		if (strncmp(de->d_name, name, len) == 0)
+			return atoi(de->d_name + len);
+	}
+	return -1;
+}
+
+
+/* A listing resumed from a telldir() cookie goes on where it left off */
+void test_readdir() {
+	static int seen[N_ENTRIES], rest[N_ENTRIES];
+	create_empty("ent", N_ENTRIES);
+
+	DIR *dir = opendir(SPACE);
+	if (dir == NULL)
+		fail("readdir", "opendir");
+	long cookie = -1;
+	int n = 0, n_rest = 0, i;
+	while ((i = next_entry(dir, "ent")) != -1) {
+		if (i < 0 || i >= N_ENTRIES || seen[i]++)
+			fail("readdir", "listing");
+		if (cookie != -1)
+			rest[n_rest++] = i;
+		if (++n == N_ENTRIES / 2)
+			cookie = telldir(dir);
+	}
+	if (n != N_ENTRIES)
+		fail("readdir", "listing");
+
+	seekdir(dir, cookie);
+	for (int k = 0; k < n_rest; k++) {
+		if (next_entry(dir, "ent") != rest[k])
+			fail("readdir", "resume");
+	}
+	if (next_entry(dir, "ent") != -1)
+		fail("readdir", "resume");
+	closedir(dir);
+
+	unlink_space("ent", N_ENTRIES);
+}
+
+
+/* Shrinking frees the blocks past the new end, growing again reads zeros there */
+void test_truncate() {
+	create_empty("trunc", 1);
+	long before = free_blocks();
+
+	int fd = open_space("trunc", 0, O_RDWR);
+	for (int b = 0; b < TRUNC_BLOCKS; b++) {
+		fill_random(buf, b);
+		if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE)
+			fail("truncate", "write");
+	}
+	fsync(fd);
+	long full = free_blocks();
+
+	/* cut inside block 10, everything after it goes */
+	struct stat st;
+	if (ftruncate(fd, 10*BLOCKSIZE + 100) < 0)
+		fail("truncate", "shrink");
+	fstat(fd, &st);
+	if (st.st_size != 10*BLOCKSIZE + 100 || wait_free(full + TRUNC_BLOCKS - 11) < 0)
+		fail("truncate", "shrink");
+
+	if (ftruncate(fd, 2 * TRUNC_BLOCKS * BLOCKSIZE) < 0)
+		fail("truncate", "grow");
+	fstat(fd, &st);
+	if (st.st_size != 2 * TRUNC_BLOCKS * BLOCKSIZE)
+		fail("truncate", "grow");
+	for (int b = 0; b < 2 * TRUNC_BLOCKS; b++) {
+		if (b <= 10)
+			fill_random(cmp, b);
+		else
+			memset(cmp, 0, BLOCKSIZE);
+		if (b == 10)
+			memset(cmp + 100, 0, BLOCKSIZE - 100);
+		if (pread(fd, buf, BLOCKSIZE, (off_t)b * BLOCKSIZE) != BLOCKSIZE || memcmp(buf, cmp, BLOCKSIZE) != 0)
+			fail("truncate", "read");
+	}
+	close(fd);
+
+	unlink_space("trunc", 1);
+	if (wait_free(before) < 0)
+		fail("truncate", "unlink");
+}
+
+
+/* A write far past the end leaves a hole that takes no blocks and reads zeros */
+void test_holes() {
+	create_empty("sparse", 1);
+	long before = free_blocks();
+
+	int fd = open_space("sparse", 0, O_RDWR);
+	memset(buf, 0x5a, BLOCKSIZE);
+	if (pwrite(fd, buf, BLOCKSIZE, (off_t)HOLE_AT * BLOCKSIZE) != BLOCKSIZE)
+		fail("holes", "write");
+	fsync(fd);
+
+	/* the block written and the indirect block that maps it */
+	struct stat st;
+	fstat(fd, &st);
+	if (st.st_size != (off_t)(HOLE_AT + 1) * BLOCKSIZE || before - free_blocks() > 2 ||
+			st.st_blocks * 512 > 2 * BLOCKSIZE)
+		fail("holes", "allocation");
+
+	memset(cmp, 0, BLOCKSIZE);
+	for (int b = 0; b < HOLE_AT; b++) {
+		if (read(fd, buf, BLOCKSIZE) != BLOCKSIZE || memcmp(buf, cmp, BLOCKSIZE) != 0)
+			fail("holes", "read");
+	}
+	memset(cmp, 0x5a, BLOCKSIZE);
+	if (read(fd, buf, BLOCKSIZE) != BLOCKSIZE || memcmp(buf, cmp, BLOCKSIZE) != 0)
+		fail("holes", "read");
+	close(fd);
+
+	unlink_space("sparse", 1);
+	if (wait_free(before) < 0)
+		fail("holes", "unlink");
+}
+
+
+/* Reserved blocks read as zeros, punched ones come free and read as zeros */
+void test_fallocate() {
+	create_empty("falloc", 1);
+	long before = free_blocks();
+
+	/* KEEP_SIZE reserves the blocks and leaves the size alone */
+	struct stat st;
+	int fd = open_space("falloc", 0, O_RDWR);
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, FALLOC_BLOCKS * BLOCKSIZE) < 0)
+		fail("fallocate", "keep size");
+	fstat(fd, &st);
+	long reserved = free_blocks();
+	if (st.st_size != 0 || before - reserved < FALLOC_BLOCKS)
+		fail("fallocate", "keep size");
+
+	/* without it the size grows over the same blocks, which read as zeros */
+	if (fallocate(fd, 0, 0, FALLOC_BLOCKS * BLOCKSIZE) < 0)
+		fail("fallocate", "extend");
+	fstat(fd, &st);
+	if (st.st_size != FALLOC_BLOCKS * BLOCKSIZE || free_blocks() != reserved)
+		fail("fallocate", "extend");
+	memset(cmp, 0, BLOCKSIZE);
+	for (int b = 0; b < FALLOC_BLOCKS; b++) {
+		if (read(fd, buf, BLOCKSIZE) != BLOCKSIZE || memcmp(buf, cmp, BLOCKSIZE) != 0)
+			fail("fallocate", "read");
+	}
+
+	/* punch blocks 4 to 11 whole and part of block 20 */
+	for (int b = 0; b < FALLOC_BLOCKS; b++) {
+		fill_random(buf, b);
+		if (pwrite(fd, buf, BLOCKSIZE, (off_t)b * BLOCKSIZE) != BLOCKSIZE)
+			fail("fallocate", "write");
+	}
+	fsync(fd);
+	long full = free_blocks();
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 4*BLOCKSIZE, 8*BLOCKSIZE) < 0 ||
+			fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 20*BLOCKSIZE + 100, 200) < 0)
+		fail("fallocate", "punch");
+	fsync(fd);
+	fstat(fd, &st);
+	if (st.st_size != FALLOC_BLOCKS * BLOCKSIZE || wait_free(full + 8) < 0)
+		fail("fallocate", "punch");
+	for (int b = 0; b < FALLOC_BLOCKS; b++) {
+		if (b >= 4 && b < 12)
+			memset(cmp, 0, BLOCKSIZE);
+		else
+			fill_random(cmp, b);
+		if (b == 20)
+			memset(cmp + 100, 0, 200);
+		if (pread(fd, buf, BLOCKSIZE, (off_t)b * BLOCKSIZE) != BLOCKSIZE || memcmp(buf, cmp, BLOCKSIZE) != 0)
+			fail("fallocate", "read");
+	}
+	close(fd);
+
+	unlink_space("falloc", 1);
+	if (wait_free(before) < 0)
+		fail("fallocate", "unlink");
+}
+
+
+/* NOREPLACE keeps an existing target, EXCHANGE swaps two names */
+void test_rename() {
+	write_space("ren", 0, 'a', 100);
+	write_space("ren", 1, 'b', 200);
+
+	if (rename_space("ren", 0, "ren", 1, RENAME_NOREPLACE) == 0 || errno != EEXIST ||
+			!space_holds("ren", 0, 'a', 100) || !space_holds("ren", 1, 'b', 200))
+		fail("rename", "noreplace");
+	if (rename_space("ren", 0, "ren", 1, RENAME_EXCHANGE) != 0 ||
+			!space_holds("ren", 0, 'b', 200) || !space_holds("ren", 1, 'a', 100))
+		fail("rename", "exchange");
+
+	/* an exchange needs both names, a move to a free name needs neither flag */
+	if (rename_space("ren", 0, "ren", 2, RENAME_EXCHANGE) == 0 || errno != ENOENT)
+		fail("rename", "exchange");
+	if (rename_space("ren", 0, "ren", 2, RENAME_NOREPLACE | RENAME_EXCHANGE) == 0 || errno != EINVAL)
+		fail("rename", "flags");
+	if (rename_space("ren", 0, "ren", 2, RENAME_NOREPLACE) != 0 ||
+			access(space_path("ren", 0), F_OK) == 0 || !space_holds("ren", 2, 'b', 200))
+		fail("rename", "noreplace");
+
+	/* a plain rename replaces the target */
+	char from[FSPATHLEN];
+	strcpy(from, space_path("ren", 1));
+	if (rename(from, space_path("ren", 2)) != 0 || access(from, F_OK) == 0 ||
+			!space_holds("ren", 2, 'a', 100))
+		fail("rename", "replace");
+
+	if (unlink(space_path("ren", 2)) < 0)
+		fail("rename", "unlink");
+}
+
+
+/* An unlinked file stays usable while open and gives its blocks back on close */
+void test_unlink_open() {
+	create_empty("open", 1);
+	long before = free_blocks();
+
+	int fd = open_space("open", 0, O_RDWR);
+	for (int b = 0; b < OPEN_BLOCKS; b++) {
+		fill_random(buf, b);
+		if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE)
+			fail("unlink open", "write");
+	}
+	fsync(fd);
+	long held = free_blocks();
+
+	struct stat st;
+	unlink_space("open", 1);
+	if (stat(space_path("open", 0), &st) == 0 || errno != ENOENT)
+		fail("unlink open", "unlink");
+
+	/* the data is still there, and the file still takes writes */
+	fill_random(buf, OPEN_BLOCKS);
+	if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE)
+		fail("unlink open", "write");
+	for (int b = 0; b <= OPEN_BLOCKS; b++) {
+		fill_random(cmp, b);
+		if (pread(fd, buf, BLOCKSIZE, (off_t)b * BLOCKSIZE) != BLOCKSIZE || memcmp(buf, cmp, BLOCKSIZE) != 0)
+			fail("unlink open", "read");
+	}
+	fstat(fd, &st);
+	if (st.st_size != (off_t)(OPEN_BLOCKS + 1) * BLOCKSIZE || free_blocks() > held)
+		fail("unlink open", "blocks");
+	close(fd);
+
+	if (wait_free(before) < 0)
+		fail("unlink open", "close");
+}
+
+
+/* fsync and fdatasync succeed after every write, and O_SYNC writes land too */
+void test_fsync() {
+	create_empty("sync", 2);
+	long before = free_blocks();
+
+	int fd = open_space("sync", 0, O_WRONLY);
+	for (int b = 0; b < SYNC_WRITES; b++) {
+		fill_random(buf, b);
+		if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE)
+			fail("fsync", "write");
+		if ((b % 2 == 0 ? fsync(fd) : fdatasync(fd)) < 0)
+			fail("fsync", "sync");
+	}
+	close(fd);
+
+	fd = open_space("sync", 1, O_WRONLY | O_SYNC);
+	for (int b = 0; b < SYNC_WRITES; b++) {
+		fill_random(buf, b);
+		if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE)
+			fail("fsync", "O_SYNC write");
+	}
+	if (fsync(fd) < 0)
+		fail("fsync", "sync");
+	close(fd);
+
+	for (int i = 0; i < 2; i++) {
+		fd = open_space("sync", i, O_RDONLY);
+		for (int b = 0; b < SYNC_WRITES; b++) {
+			fill_random(cmp, b);
+			if (read(fd, buf, BLOCKSIZE) != BLOCKSIZE || memcmp(buf, cmp, BLOCKSIZE) != 0)
+				fail("fsync", "read");
+		}
+		close(fd);
+	}
+
+	unlink_space("sync", 2);
+	if (wait_free(before) < 0)
+		fail("fsync", "unlink");
+}
+
+
+/* Random overwrites move blocks to the log head; the ones they replace come
+ * free again and the file reads back its latest contents */
+void test_logwrite() {
+	static int version[LOG_BLOCKS];
+	create_empty("log", 1);
+	long before = free_blocks();
+
+	int fd = open_space("log", 0, O_RDWR);
+	for (int b = 0; b < LOG_BLOCKS; b++) {
+		version[b] = b;
+		fill_random(buf, b);
+		if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE)
+			fail("logwrite", "write");
+	}
+	fsync(fd);
+	long used = before - free_blocks();
+
+	unsigned int seed = 1;
+	for (int k = 0; k < LOG_OVERWRITES; k++) {
+		int b = rand_r(&seed) % LOG_BLOCKS;
+		version[b] = LOG_BLOCKS + k;
+		fill_random(buf, version[b]);
+		if (pwrite(fd, buf, BLOCKSIZE, (off_t)b * BLOCKSIZE) != BLOCKSIZE)
+			fail("logwrite", "overwrite");
+		if (k % 64 == 63)
+			fsync(fd);
+	}
+	fsync(fd);
+	if (wait_free(before - used) < 0) {
+		printf("logwrite: %ld blocks used, %ld before the overwrites \n", before - free_blocks(), used);
+		fail("logwrite", "space");
+	}
+
+	for (int b = 0; b < LOG_BLOCKS; b++) {
+		fill_random(cmp, version[b]);
+		if (pread(fd, buf, BLOCKSIZE, (off_t)b * BLOCKSIZE) != BLOCKSIZE || memcmp(buf, cmp, BLOCKSIZE) != 0)
+			fail("logwrite", "read");
+	}
+	close(fd);
+
+	unlink_space("log", 1);
+	if (wait_free(before) < 0)
+		fail("logwrite", "unlink");
+}
+
+
+/* Identical files share their blocks */
+void test_dedup() {
+	create_empty("same", N_COPIES + 1);
+	long before = free_blocks();
+
+	struct rufs_dedup_stats ds_before, ds_after;
+	dedup_stats(&ds_before);
+	for (int i = 0; i < N_COPIES; i++) {
+		int fd = open_space("same", i, O_WRONLY);
+		for (int b = 0; b < SHARED_BLOCKS; b++) {
+			fill_random(buf, b);
+			if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE)
+				fail("dedup", "write");
+		}
+		fsync(fd);
+		close(fd);
+	}
+	dedup_stats(&ds_after);
+	if (ds_after.shared - ds_before.shared < (N_COPIES - 1) * SHARED_BLOCKS ||
+			before - free_blocks() >= 2 * SHARED_BLOCKS) {
+		printf("dedup: %lu blocks shared, %ld used \n",
+			(unsigned long)(ds_after.shared - ds_before.shared), before - free_blocks());
+		fail("dedup", "sharing");
+	}
+
+	/* a clone adds no data blocks, an overwrite changes one copy only */
+	long used = free_blocks();
+	clone_space("same", N_COPIES, "same", 0);
+	if (used - free_blocks() > 1)
+		fail("dedup", "clone");
+
+	int fd = open_space("same", 1, O_WRONLY);
+	memset(buf, 0x7a, BLOCKSIZE);
+	if (pwrite(fd, buf, BLOCKSIZE, 5*BLOCKSIZE) != BLOCKSIZE)
+		fail("dedup", "overwrite");
+	fsync(fd);
+	close(fd);
+
+	for (int i = 0; i < N_COPIES + 1; i++) {
+		fd = open_space("same", i, O_RDONLY);
+		for (int b = 0; b < SHARED_BLOCKS; b++) {
+			if (i == 1 && b == 5)
+				memset(cmp, 0x7a, BLOCKSIZE);
+			else
+				fill_random(cmp, b);
+			if (read(fd, buf, BLOCKSIZE) != BLOCKSIZE || memcmp(buf, cmp, BLOCKSIZE) != 0)
+				fail("dedup", "read");
+		}
+		close(fd);
+	}
+
+	unlink_space("same", N_COPIES + 1);
+	if (wait_free(before) < 0)
+		fail("dedup", "unlink");
+}
+
+
+/* Compressible data takes fewer blocks, and a clone of it can be overwritten */
+void test_compress() {
+	create_empty("text", 2);
+	long before = free_blocks();
+
+	int fd = open_space("text", 0, O_WRONLY);
+	for (int b = 0; b < PACKED_BLOCKS; b++) {
+		fill_text(buf, b);
+		if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE)
+			fail("compress", "write");
+	}
+	fsync(fd);
+	close(fd);
+	if (before - free_blocks() >= PACKED_BLOCKS / 2) {
+		printf("compress: %ld blocks used \n", before - free_blocks());
+		fail("compress", "packing");
+	}
+
+	clone_space("text", 1, "text", 0);
+	fd = open_space("text", 1, O_WRONLY);
+	memset(buf, 0x7a, BLOCKSIZE);
+	if (pwrite(fd, buf, BLOCKSIZE, 9*BLOCKSIZE) != BLOCKSIZE)
+		fail("compress", "overwrite");
+	fsync(fd);
+	close(fd);
+
+	for (int i = 0; i < 2; i++) {
+		fd = open_space("text", i, O_RDONLY);
+		for (int b = 0; b < PACKED_BLOCKS; b++) {
+			if (i == 1 && b == 9)
+				memset(cmp, 0x7a, BLOCKSIZE);
+			else
+				fill_text(cmp, b);
+			if (read(fd, buf, BLOCKSIZE) != BLOCKSIZE || memcmp(buf, cmp, BLOCKSIZE) != 0)
+				fail("compress", "read");
+		}
+		close(fd);
+	}
+
+	unlink_space("text", 2);
+	if (wait_free(before) < 0)
+		fail("compress", "unlink");
+}
+
+
+/* Small files share blocks for their tails */
+void test_tailpack() {
+	create_empty("tail", N_TAILS + 1);
+	long before = free_blocks();
+
+	for (int i = 0; i < N_TAILS; i++) {
+		int fd = open_space("tail", i, O_WRONLY);
+		memset(buf, 0x41 + i % 26, 100 + i);
+		if (write(fd, buf, 100 + i) != 100 + i)
+			fail("tailpack", "write");
+		fsync(fd);
+		close(fd);
+	}
+	if (before - free_blocks() >= N_TAILS / 2) {
+		printf("tailpack: %ld blocks used \n", before - free_blocks());
+		fail("tailpack", "packing");
+	}
+
+	clone_space("tail", N_TAILS, "tail", 0);
+	int fd = open_space("tail", N_TAILS, O_WRONLY);
+	if (pwrite(fd, "zz", 2, 10) != 2)
+		fail("tailpack", "overwrite");
+	fsync(fd);
+	close(fd);
+
+	for (int i = 0; i < N_TAILS + 1; i++) {
+		int src = i < N_TAILS ? i : 0;
+		int len = 100 + src;
+		memset(cmp, 0x41 + src % 26, len);
+		if (i == N_TAILS)
+			memcpy(cmp + 10, "zz", 2);
+		fd = open_space("tail", i, O_RDONLY);
+		if (read(fd, buf, BLOCKSIZE) != len || memcmp(buf, cmp, len) != 0)
+			fail("tailpack", "read");
+		close(fd);
+	}
+
+	unlink_space("tail", N_TAILS + 1);
+	if (wait_free(before) < 0)
+		fail("tailpack", "unlink");
+}
+
+
+struct feature_test {
+	const char *name;
+	const char *option;			/* mount option it needs, NULL if none */
+	void (*run)();
+};
+
+struct feature_test tests[] = {
+	{ "inodes",	NULL,		test_inodes },
+	{ "readdir",	NULL,		test_readdir },
+	{ "truncate",	NULL,		test_truncate },
+	{ "holes",	NULL,		test_holes },
+	{ "fallocate",	NULL,		test_fallocate },
+	{ "rename",	NULL,		test_rename },
+	{ "unlink open",	NULL,		test_unlink_open },
+	{ "fsync",	NULL,		test_fsync },
+	{ "logwrite",	"logwrite",	test_logwrite },
+	{ "dedup",	"dedup",	test_dedup },
+	{ "compress",	"compress",	test_compress },
+	{ "tailpack",	"tailpack",	test_tailpack },
+};
+
+int mounted_with(int argc, char **argv, const char *option) {
+	for (int i = 1; i < argc; i++)
+		if (strcmp(argv[i], option) == 0)
+			return 1;
+	return 0;
+}
+
+int main(int argc, char **argv) {
+
+	struct timeval start;
+	struct timeval end;
+	gettimeofday(&start, NULL);
+
+	if (mkdir(SPACE, DIRPERM) < 0) {
+		perror("mkdir");
+		printf("Check if dir %s already exists, and "
+			"if it exists, manually remove and re-run \n", SPACE);
+		exit(1);
+	}
+
+	for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		if (tests[i].option != NULL && !mounted_with(argc, argv, tests[i].option)) {
+			printf("%s: skipped, needs -o %s \n", tests[i].name, tests[i].option);
+			continue;
+		}
+		tests[i].run();
+		printf("%s: Success \n", tests[i].name);
+	}
+
+	if (rmdir(SPACE) < 0) {
+		perror("rmdir");
+		exit(1);
+	}
+
+	printf("Feature tests completed \n");
+
+	gettimeofday(&end, NULL);
+	printf("Elapsed time: %0.8f sec\n", time_diff(&start, &end));
+
+	return 0;
+}
@@ -136,12 +136,6 @@ int main(int argc, char **argv) {
 	printf("TEST 7: Sub-directory create success \n");
 
 
-	/* Close operation */	
-	if (close(fd) < 0) {
-		perror("close largefile");
-		exit(1);
-	}
-
 	printf("Benchmark completed \n");
 
 	gettimeofday(&end, NULL);
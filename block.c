@@ -11,9 +11,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #include "block.h"
 
@@ -22,6 +24,63 @@
 
 int diskfile = -1;
 
+/*
+ * Block cache
+ * Write-through: bio_write always goes to the disk and leaves its data in
+ * the cache, so every cached copy is current. bio_prefetch hands block
+ * numbers to a background thread that reads them in ahead of time.
+ * The one exception is bio_write_pinned: the journal stages metadata in
+ * the cache ahead of the disk, and those entries stay put until
+ * bio_checkpoint writes them home (or a plain bio_write replaces them).
+ */
+#define CACHE_BLOCKS	1024
+#define CACHE_HASH		2048
+#define PREFETCH_QUEUE	256
+
+#define CE_VALID	0
+#define CE_LOADING	1		/* prefetch read in progress */
+#define CE_STALE	2		/* written while loading, drop when it lands */
+
+struct cache_entry {
+	int block_num;						/* -1 if unused */
+	int state;
+	int prefetched;						/* read ahead and not used yet */
+	int pinned;							/* newer than the disk, cannot be evicted */
+	struct cache_entry *hnext;			/* hash chain */
+	struct cache_entry *prev, *next;	/* LRU list, most recent first */
+	char data[BLOCK_SIZE];
+};
+
+struct cache_entry *cache_entries = NULL;
+struct cache_entry *cache_hash[CACHE_HASH];
+struct cache_entry *lru_head = NULL, *lru_tail = NULL;
+struct bio_stats cache_stats;
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Block checksums
+ * Every write that reaches the disk (or is pinned to reach it) records the
+ * CRC32C of the block in a table the file system keeps and commits, and
+ * marks the table block dirty. bio_read and friends check what comes back
+ * from the disk: metadata blocks (those below meta_below, or last written
+ * with bio_write_pinned / bio_write_meta) with CSUM_VERIFY_META, all blocks
+ * with CSUM_VERIFY_ALL. A mismatch reads as zeros and returns -1.
+ * The table's own blocks are not covered. All of it is under cache_lock.
+ */
+uint32_t *sum_table = NULL;
+unsigned char *sum_meta = NULL;
+unsigned char *sum_dirty = NULL;
+int sum_nblocks = 0;
+int sum_table_blk = 0;
+int sum_meta_below = 0;
+int sum_verify = CSUM_VERIFY_NONE;
+
+int prefetch_queue[PREFETCH_QUEUE];
+int prefetch_head = 0, prefetch_count = 0;
+int prefetch_stop = 0;
+pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+pthread_t prefetch_thread;
+
 //Creates a file which is your new emulated disk
 void dev_init(const char* diskfile_path) {
     if (diskfile >= 0) {
@@ -57,26 +116,548 @@ void dev_close() {
     }
 }
 
+/*
+ * CRC32C (Castagnoli), with the SSE4.2 crc32 instruction when the CPU has
+ * it and slice-by-8 tables otherwise
+ */
+#define CRC32C_POLY 0x82F63B78		/* reflected */
+
+uint32_t crc32c_table[8][256];
+int crc32c_hw = 0;
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init() {
+	for (int i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][i] = crc;
+	}
+	for (int i = 0; i < 256; i++)
+		for (int t = 1; t < 8; t++)
+			crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+
+#if defined(__x86_64__)
+	crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+	while (len >= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		w ^= crc;
+		crc = crc32c_table[7][w & 0xff] ^ crc32c_table[6][(w >> 8) & 0xff] ^
+		      crc32c_table[5][(w >> 16) & 0xff] ^ crc32c_table[4][(w >> 24) & 0xff] ^
+		      crc32c_table[3][(w >> 32) & 0xff] ^ crc32c_table[2][(w >> 40) & 0xff] ^
+		      crc32c_table[1][(w >> 48) & 0xff] ^ crc32c_table[0][w >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t crc64 = crc;
+	while (len >= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, w);
+		p += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)crc64;
+	while (len-- > 0)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	return crc;
+}
+#endif
+
+unsigned int crc32c(unsigned int crc, const void *buf, unsigned long len) {
+	pthread_once(&crc32c_once, crc32c_init);
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (crc32c_hw)
+		return ~crc32c_sse42(crc, buf, len);
+#endif
+	return ~crc32c_sw(crc, buf, len);
+}
+
+const char *crc32c_impl() {
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_hw ? "sse4.2" : "slice-by-8";
+}
+
+static int csum_covered(int block_num) {
+	return sum_table != NULL && block_num >= 0 && block_num < sum_nblocks &&
+	       (block_num < sum_table_blk || block_num >= sum_table_blk + CSUM_TABLE_BLKS(sum_nblocks));
+}
+
+// Record the checksum of what is being written to block_num (cache_lock held)
+static void csum_set(int block_num, const void *buf, int meta) {
+	if (!csum_covered(block_num))
+		return;
+
+	uint32_t sum = crc32c(0, buf, BLOCK_SIZE);
+	if (sum == 0)
+		sum = 1;					/* 0 means unknown */
+	if (sum_table[block_num] != sum) {
+		sum_table[block_num] = sum;
+		sum_dirty[block_num * 4 / BLOCK_SIZE] = 1;
+	}
+
+	unsigned char bit = 1 << (block_num & 7);
+	if (((sum_meta[block_num / 8] & bit) != 0) != (meta != 0)) {
+		sum_meta[block_num / 8] ^= bit;
+		sum_dirty[CSUM_SUMS_BLKS(sum_nblocks) + block_num / 8 / BLOCK_SIZE] = 1;
+	}
+}
+
+// Check a block read from the disk (cache_lock held); on a mismatch the
+// buffer is zeroed
+static int csum_check(int block_num, void *buf) {
+	if (sum_verify == CSUM_VERIFY_NONE || !csum_covered(block_num) || sum_table[block_num] == 0)
+		return 0;
+	if (sum_verify != CSUM_VERIFY_ALL && block_num >= sum_meta_below &&
+	    !(sum_meta[block_num / 8] & (1 << (block_num & 7))))
+		return 0;
+
+	uint32_t sum = crc32c(0, buf, BLOCK_SIZE);
+	if ((sum == 0 ? 1 : sum) == sum_table[block_num])
+		return 0;
+
+	fprintf(stderr, "block %d: checksum mismatch\n", block_num);
+	cache_stats.csum_errors++;
+	memset(buf, 0, BLOCK_SIZE);
+	return -1;
+}
+
+/*
+ * Start keeping checksums in table, which covers blocks 0..nblocks-1 and
+ * is stored at table_blk. Blocks below meta_below are metadata. dirty has
+ * a flag per table block, set when that block changes.
+ */
+void bio_csum_attach(void *table, int nblocks, int table_blk, int meta_below, int verify, unsigned char *dirty) {
+	pthread_once(&crc32c_once, crc32c_init);
+	pthread_mutex_lock(&cache_lock);
+	sum_table = table;
+	sum_meta = (unsigned char *)table + (size_t)CSUM_SUMS_BLKS(nblocks) * BLOCK_SIZE;
+	sum_dirty = dirty;
+	sum_nblocks = nblocks;
+	sum_table_blk = table_blk;
+	sum_meta_below = meta_below;
+	sum_verify = verify;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void bio_csum_detach() {
+	pthread_mutex_lock(&cache_lock);
+	sum_table = NULL;
+	sum_meta = NULL;
+	sum_dirty = NULL;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Forget the checksums of blocks last written as data. Data goes to the
+ * disk straight away, its checksum only with the next journal commit, so
+ * after a crash these may not match without anything being wrong.
+ */
+void bio_csum_forget_data() {
+	pthread_mutex_lock(&cache_lock);
+	for (int i = sum_meta_below; sum_table != NULL && i < sum_nblocks; i++) {
+		if (!csum_covered(i) || sum_table[i] == 0 || (sum_meta[i / 8] & (1 << (i & 7))))
+			continue;
+		sum_table[i] = 0;
+		sum_dirty[i * 4 / BLOCK_SIZE] = 1;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * cache internals, all called with cache_lock held
+ */
+static struct cache_entry *cache_lookup(int block_num) {
+	struct cache_entry *e = cache_hash[block_num % CACHE_HASH];
+	while (e != NULL && e->block_num != block_num)
+		e = e->hnext;
+	return e;
+}
+
+static void lru_unlink(struct cache_entry *e) {
+	if (e->prev) e->prev->next = e->next; else lru_head = e->next;
+	if (e->next) e->next->prev = e->prev; else lru_tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void lru_push(struct cache_entry *e) {
+	e->prev = NULL;
+	e->next = lru_head;
+	if (lru_head) lru_head->prev = e; else lru_tail = e;
+	lru_head = e;
+}
+
+static void cache_remove(struct cache_entry *e) {
+	struct cache_entry **pp = &cache_hash[e->block_num % CACHE_HASH];
+	while (*pp != e)
+		pp = &(*pp)->hnext;
+	*pp = e->hnext;
+	if (e->prefetched)
+		cache_stats.ra_waste++;
+	e->block_num = -1;
+	e->prefetched = 0;
+	e->pinned = 0;
+}
+
+// Take the least recently used entry that is not being loaded or pinned
+static struct cache_entry *cache_alloc(int block_num) {
+	struct cache_entry *e = lru_tail;
+	while (e != NULL && (e->state == CE_LOADING || e->pinned))
+		e = e->prev;
+	if (e == NULL)
+		return NULL;
+	if (e->block_num != -1)
+		cache_remove(e);
+	lru_unlink(e);
+	lru_push(e);
+	e->block_num = block_num;
+	e->state = CE_VALID;
+	e->prefetched = 0;
+	e->hnext = cache_hash[block_num % CACHE_HASH];
+	cache_hash[block_num % CACHE_HASH] = e;
+	return e;
+}
+
+static void *prefetch_main(void *arg) {
+	pthread_mutex_lock(&cache_lock);
+	while (1) {
+		while (prefetch_count == 0 && !prefetch_stop)
+			pthread_cond_wait(&prefetch_cond, &cache_lock);
+		if (prefetch_stop)
+			break;
+
+		int block_num = prefetch_queue[prefetch_head];
+		prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE;
+		prefetch_count--;
+
+		if (cache_lookup(block_num) != NULL)
+			continue;
+		struct cache_entry *e = cache_alloc(block_num);
+		if (e == NULL)
+			continue;
+		e->state = CE_LOADING;
+		pthread_mutex_unlock(&cache_lock);
+
+		int retstat = pread(diskfile, e->data, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+
+		pthread_mutex_lock(&cache_lock);
+		if (retstat != BLOCK_SIZE || e->state == CE_STALE || csum_check(block_num, e->data) != 0) {
+			e->state = CE_VALID;
+			cache_remove(e);
+		} else {
+			e->state = CE_VALID;
+			e->prefetched = 1;
+			cache_stats.ra_issued++;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return NULL;
+}
+
+//Set up the block cache and start the read-ahead thread
+void bio_cache_init() {
+	if (cache_entries != NULL)
+		return;
+
+	cache_entries = calloc(CACHE_BLOCKS, sizeof(struct cache_entry));
+	memset(cache_hash, 0, sizeof(cache_hash));
+	memset(&cache_stats, 0, sizeof(cache_stats));
+	lru_head = lru_tail = NULL;
+	for (int i = 0; i < CACHE_BLOCKS; i++) {
+		cache_entries[i].block_num = -1;
+		lru_push(&cache_entries[i]);
+	}
+
+	prefetch_head = prefetch_count = prefetch_stop = 0;
+	pthread_create(&prefetch_thread, NULL, prefetch_main, NULL);
+}
+
+void bio_cache_destroy() {
+	if (cache_entries == NULL)
+		return;
+
+	pthread_mutex_lock(&cache_lock);
+	prefetch_stop = 1;
+	pthread_cond_signal(&prefetch_cond);
+	pthread_mutex_unlock(&cache_lock);
+	pthread_join(prefetch_thread, NULL);
+
+	free(cache_entries);
+	cache_entries = NULL;
+}
+
+//Queue blocks to be read into the cache in the background
+void bio_prefetch(const int *block_nums, int count) {
+	if (cache_entries == NULL)
+		return;
+
+	pthread_mutex_lock(&cache_lock);
+	for (int i = 0; i < count && prefetch_count < PREFETCH_QUEUE; i++) {
+		if (block_nums[i] <= 0 || cache_lookup(block_nums[i]) != NULL)
+			continue;
+		prefetch_queue[(prefetch_head + prefetch_count) % PREFETCH_QUEUE] = block_nums[i];
+		prefetch_count++;
+	}
+	pthread_cond_signal(&prefetch_cond);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void bio_stats(struct bio_stats *stats) {
+	pthread_mutex_lock(&cache_lock);
+	memcpy(stats, &cache_stats, sizeof(struct bio_stats));
+	pthread_mutex_unlock(&cache_lock);
+}
+
 //Read a block from the disk
 int bio_read(const int block_num, void *buf) {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+
+    if (cache_entries != NULL && block_num >= 0) {
+		pthread_mutex_lock(&cache_lock);
+		struct cache_entry *e = cache_lookup(block_num);
+		if (e != NULL && e->state == CE_VALID) {
+			memcpy(buf, e->data, BLOCK_SIZE);
+			lru_unlink(e);
+			lru_push(e);
+			cache_stats.hits++;
+			if (e->prefetched) {
+				cache_stats.ra_hits++;
+				e->prefetched = 0;
+			}
+			pthread_mutex_unlock(&cache_lock);
+			return BLOCK_SIZE;
+		}
+		cache_stats.misses++;
+		pthread_mutex_unlock(&cache_lock);
+    }
+
+    retstat = pread(diskfile, buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
     if (retstat <= 0) {
 		memset (buf, 0, BLOCK_SIZE);
 		if (retstat < 0)
 			perror("block_read failed");
     }
 
+    if (retstat == BLOCK_SIZE && sum_table != NULL) {
+		pthread_mutex_lock(&cache_lock);
+		if (csum_check(block_num, buf) != 0)
+			retstat = -1;
+		pthread_mutex_unlock(&cache_lock);
+    }
+
+    // a concurrent bio_write always leaves its entry behind, so only
+    // insert if nobody got there first
+    if (retstat == BLOCK_SIZE && cache_entries != NULL) {
+		pthread_mutex_lock(&cache_lock);
+		if (cache_lookup(block_num) == NULL) {
+			struct cache_entry *e = cache_alloc(block_num);
+			if (e != NULL)
+				memcpy(e->data, buf, BLOCK_SIZE);
+		}
+		pthread_mutex_unlock(&cache_lock);
+    }
+
+    return retstat;
+}
+
+// Bring the cache in line with a write of block_num; ok is false if the
+// write to disk failed
+static void cache_update(int block_num, const void *buf, int ok) {
+	struct cache_entry *e = cache_lookup(block_num);
+	if (e != NULL && e->state != CE_VALID) {
+		e->state = CE_STALE;
+	} else if (!ok) {
+		if (e != NULL)
+			cache_remove(e);
+	} else {
+		if (e == NULL)
+			e = cache_alloc(block_num);
+		if (e != NULL) {
+			memcpy(e->data, buf, BLOCK_SIZE);
+			e->prefetched = 0;
+			e->pinned = 0;
+			lru_unlink(e);
+			lru_push(e);
+		}
+	}
+}
+
+static int bio_write_kind(const int block_num, const void *buf, int meta) {
+    int retstat = 0;
+    retstat = pwrite(diskfile, buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+    if (retstat < 0) {
+		    perror("block_write failed");
+    }
+
+    if ((cache_entries != NULL || sum_table != NULL) && block_num >= 0) {
+		pthread_mutex_lock(&cache_lock);
+		if (cache_entries != NULL)
+			cache_update(block_num, buf, retstat == BLOCK_SIZE);
+		if (retstat == BLOCK_SIZE)
+			csum_set(block_num, buf, meta);
+		pthread_mutex_unlock(&cache_lock);
+    }
     return retstat;
 }
 
 //Write a block to the disk
 int bio_write(const int block_num, const void *buf) {
+    return bio_write_kind(block_num, buf, 0);
+}
+
+//Write a metadata block to the disk, its checksum is checked on every read
+int bio_write_meta(const int block_num, const void *buf) {
+    return bio_write_kind(block_num, buf, 1);
+}
+
+//Write count consecutive blocks starting at block_num in a single request
+int bio_write_blocks(const int block_num, int count, const void *buf) {
+    int retstat = 0;
+    retstat = pwrite(diskfile, buf, (size_t)count*BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+    if (retstat < 0) {
+		    perror("block_write failed");
+    }
+
+    if ((cache_entries != NULL || sum_table != NULL) && block_num >= 0) {
+		pthread_mutex_lock(&cache_lock);
+		for (int i = 0; i < count; i++) {
+			const char *data = (const char *)buf + (size_t)i*BLOCK_SIZE;
+			if (cache_entries != NULL)
+				cache_update(block_num + i, data, retstat == count*BLOCK_SIZE);
+			if (retstat == count*BLOCK_SIZE)
+				csum_set(block_num + i, data, 0);
+		}
+		pthread_mutex_unlock(&cache_lock);
+    }
+    return retstat;
+}
+
+//Read count consecutive blocks starting at block_num in a single request.
+//The cache is write-through, so the disk is current; bulk reads bypass the
+//cache rather than flushing it with blocks read once
+int bio_read_blocks(const int block_num, int count, void *buf) {
+    int retstat = 0;
+    retstat = pread(diskfile, buf, (size_t)count*BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+    if (retstat < count*BLOCK_SIZE) {
+		memset((char *)buf + (retstat > 0 ? retstat : 0), 0, (size_t)count*BLOCK_SIZE - (retstat > 0 ? retstat : 0));
+		if (retstat < 0)
+			perror("block_read failed");
+    }
+
+    // pinned blocks are the only ones the disk is behind on, the others
+    // are checked against their checksums
+    if ((cache_entries != NULL || sum_table != NULL) && block_num >= 0) {
+		pthread_mutex_lock(&cache_lock);
+		for (int i = 0; i < count; i++) {
+			char *data = (char *)buf + (size_t)i*BLOCK_SIZE;
+			struct cache_entry *e = cache_entries != NULL ? cache_lookup(block_num + i) : NULL;
+			if (e != NULL && e->pinned)
+				memcpy(data, e->data, BLOCK_SIZE);
+			else if ((i + 1)*BLOCK_SIZE <= retstat && csum_check(block_num + i, data) != 0)
+				retstat = -1;
+		}
+		pthread_mutex_unlock(&cache_lock);
+    }
+    return retstat;
+}
+
+//Write count consecutive blocks without touching the cache, for blocks
+//that are only ever read back with bio_read_blocks (the journal)
+int bio_write_direct(const int block_num, int count, const void *buf) {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    retstat = pwrite(diskfile, buf, (size_t)count*BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
     if (retstat < 0) {
 		    perror("block_write failed");
     }
     return retstat;
 }
 
+//Stage a block in the cache without writing it. Reads see the new
+//contents; the disk keeps the old ones until bio_checkpoint.
+//Returns BLOCK_SIZE, or -1 if there is no room to pin it
+int bio_write_pinned(const int block_num, const void *buf) {
+    if (cache_entries == NULL || block_num < 0)
+		return -1;
+
+    pthread_mutex_lock(&cache_lock);
+    struct cache_entry *e = cache_lookup(block_num);
+    if (e != NULL && e->state != CE_VALID) {
+		// a read-ahead of the old contents is in flight: it is dropped
+		// when it lands, and the new entry goes ahead of it in the chain
+		e->state = CE_STALE;
+		e = NULL;
+    }
+    if (e == NULL)
+		e = cache_alloc(block_num);
+    if (e == NULL) {
+		pthread_mutex_unlock(&cache_lock);
+		return -1;
+    }
+    memcpy(e->data, buf, BLOCK_SIZE);
+    e->prefetched = 0;
+    e->pinned = 1;
+    csum_set(block_num, buf, 1);
+    lru_unlink(e);
+    lru_push(e);
+    pthread_mutex_unlock(&cache_lock);
+    return BLOCK_SIZE;
+}
+
+//Copy out the staged contents of a pinned block
+//Returns 1, or 0 if the block is not pinned (any more)
+int bio_read_pinned(const int block_num, void *buf) {
+    int found = 0;
+    if (cache_entries == NULL || block_num < 0)
+		return 0;
+
+    pthread_mutex_lock(&cache_lock);
+    struct cache_entry *e = cache_lookup(block_num);
+    if (e != NULL && e->pinned) {
+		memcpy(buf, e->data, BLOCK_SIZE);
+		found = 1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return found;
+}
+
+//Write a pinned block to its home on disk and unpin it
+int bio_checkpoint(const int block_num) {
+    int retstat = 0;
+    if (cache_entries == NULL || block_num < 0)
+		return 0;
+
+    pthread_mutex_lock(&cache_lock);
+    struct cache_entry *e = cache_lookup(block_num);
+    if (e != NULL && e->pinned) {
+		// nothing else changes a pinned entry, the caller holds it
+		retstat = pwrite(diskfile, e->data, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+		if (retstat < 0)
+			perror("block_write failed");
+		e->pinned = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return retstat;
+}
+
+//Make everything written so far durable on the device
+int bio_sync() {
+    int retstat = fdatasync(diskfile);
+    if (retstat < 0) {
+		    perror("block_sync failed");
+    }
+    return retstat;
+}
@@ -10,10 +10,52 @@
 
 #define BLOCK_SIZE 4096
 
+/* block cache counters, see bio_stats() */
+struct bio_stats {
+	unsigned long	hits;			/* bio_read served from the cache */
+	unsigned long	misses;			/* bio_read that went to the disk */
+	unsigned long	ra_issued;		/* blocks read ahead into the cache */
+	unsigned long	ra_hits;		/* read-ahead blocks later read */
+	unsigned long	ra_waste;		/* read-ahead blocks evicted unread */
+	unsigned long	csum_errors;	/* blocks read back with a bad checksum */
+};
+
+/*
+ * block checksums: a table of one CRC32C per block (0 if unknown)
+ * followed by a bitmap of the blocks last written as metadata, see
+ * bio_csum_attach()
+ */
+#define CSUM_SUMS_BLKS(n)	(((n) * 4 + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define CSUM_TABLE_BLKS(n)	(CSUM_SUMS_BLKS(n) + ((n) / 8 + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+#define CSUM_VERIFY_NONE	0
+#define CSUM_VERIFY_META	1		/* metadata blocks only */
+#define CSUM_VERIFY_ALL		2		/* data blocks too */
+
 void dev_init(const char* diskfile_path);
 int dev_open(const char* diskfile_path);
 void dev_close();
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_write_meta(const int block_num, const void *buf);
+int bio_write_blocks(const int block_num, int count, const void *buf);
+int bio_read_blocks(const int block_num, int count, void *buf);
+int bio_write_direct(const int block_num, int count, const void *buf);
+
+int bio_write_pinned(const int block_num, const void *buf);
+int bio_read_pinned(const int block_num, void *buf);
+int bio_checkpoint(const int block_num);
+int bio_sync();
+
+void bio_cache_init();
+void bio_cache_destroy();
+void bio_prefetch(const int *block_nums, int count);
+void bio_stats(struct bio_stats *stats);
+
+void bio_csum_attach(void *table, int nblocks, int table_blk, int meta_below, int verify, unsigned char *dirty);
+void bio_csum_detach();
+void bio_csum_forget_data();
+unsigned int crc32c(unsigned int crc, const void *buf, unsigned long len);
+const char *crc32c_impl();
 
 #endif
@@ -0,0 +1,571 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	fsck.c
+ *
+ *	Offline consistency checker for a RUFS DISKFILE (not mounted)
+ *
+ *	rufs_fsck [-n] [-j threads] DISKFILE
+ *
+ *	Step 1 replays a committed journal transaction like a mount would.
+ *	Step 2 scans the inode table, one inode chunk per task, and claims
+ *	every block an inode points to, directly or through its indirect
+ *	blocks. Step 3 reads every directory, one directory per task, and
+ *	counts the entries naming each inode, then walks the tree from the
+ *	root to find the inodes it reaches. Step 4 compares what was found
+ *	with the bitmaps, the block reference counts and the orphan list.
+ *	Steps 2 and the first half of 3 run on worker threads. Metadata blocks are checked
+ *	against the block checksum table as they are read; one that fails is
+ *	reported and its contents are taken as they are, for the structural
+ *	checks to repair, then written back with a new checksum.
+ *
+ *	Without -n, problems are repaired: bad pointers and dangling entries
+ *	are cleared, the bitmaps and reference counts are rebuilt, inodes the
+ *	root does not reach are put on the orphan list for the next mount to
+ *	reclaim, and ones it does reach are taken off it.
+ *
+ *	Exit status: 0 clean, 1 errors repaired, 4 errors left, 8 operational
+ *	error (as e2fsck)
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "block.h"
+#include "rufs.h"
+
+#define FSCK_MAX_THREADS 64
+
+extern int diskfile;
+
+struct superblock *sb;
+struct inode *inodes;				/* the inode table, indexed by ino */
+uint32_t *owners;					/* pointers found to each data block */
+uint32_t *names;					/* directory entries found for each inode */
+unsigned char *reached;				/* inodes the walk from the root got to */
+uint16_t *pending;					/* directories the walk has still to read */
+int n_pending = 0;
+void *csum_table;
+unsigned char csum_dirty[CSUM_BLKS];
+int repair = 1;
+int nthreads = 0;
+
+unsigned long errors = 0;			/* problems found */
+unsigned long fixed = 0;			/* of those, repaired */
+
+pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t task_lock = PTHREAD_MUTEX_INITIALIZER;
+int next_task = 0;
+
+// Print one problem; counts it as fixed when repairing and it can be
+static void problem(int fixable, const char *fmt, ...) {
+    va_list ap;
+    pthread_mutex_lock(&report_lock);
+    errors++;
+    if (repair && fixable)
+        fixed++;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf(repair && fixable ? " (fixed)\n" : "\n");
+    pthread_mutex_unlock(&report_lock);
+}
+
+static int take_task(int ntasks) {
+    pthread_mutex_lock(&task_lock);
+    int t = next_task < ntasks ? next_task++ : -1;
+    pthread_mutex_unlock(&task_lock);
+    return t;
+}
+
+static void run_workers(void *(*fn)(void *)) {
+    pthread_t threads[FSCK_MAX_THREADS];
+    next_task = 0;
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, fn, NULL);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+}
+
+static int data_blk(int p) {
+    return p >= (int)sb->d_start_blk && p < (int)(sb->d_start_blk + sb->max_dnum);
+}
+
+static void claim(int p) {
+    __atomic_fetch_add(&owners[p - sb->d_start_blk], 1, __ATOMIC_RELAXED);
+}
+
+// A block pointer names blocks inside the data region, all of a compressed
+// cluster's extent included
+static int ptr_ok(int p) {
+    if (p & BLK_COMPRESSED)
+        return BLK_CZ_LEN(p) > 0 && data_blk(BLK_NUM(p)) && data_blk(BLK_NUM(p) + BLK_CZ_LEN(p) - 1);
+    return data_blk(BLK_NUM(p));
+}
+
+// Claim the block a pointer names; the first pointer into a compressed
+// extent also claims the rest of the extent
+static void claim_ptr(int p) {
+    int blk = BLK_NUM(p);
+    if (__atomic_fetch_add(&owners[blk - sb->d_start_blk], 1, __ATOMIC_RELAXED) == 0 && (p & BLK_COMPRESSED))
+        for (int i = 1; i < BLK_CZ_LEN(p); i++)
+            claim(blk + i);
+}
+
+// Blocks that failed their checksum read as zeros; take what is on disk
+static void salvage(int blk, int count, void *buf) {
+    if (pread(diskfile, buf, (size_t)count * BLOCK_SIZE, (off_t)blk * BLOCK_SIZE) < 0)
+        memset(buf, 0, (size_t)count * BLOCK_SIZE);
+}
+
+
+/*
+ * Step 1: finish a transaction the journal committed but did not checkpoint
+ */
+static void replay_journal() {
+
+    struct journal_header *jh = malloc(BLOCK_SIZE);
+    bio_read(sb->j_start_blk, jh);
+    if (jh->magic == JOURNAL_MAGIC && jh->committed && jh->nblocks <= JOURNAL_TXN_MAX)
+    {
+        char *images = malloc((size_t)jh->nblocks * BLOCK_SIZE);
+        bio_read_blocks(sb->j_start_blk + 1, jh->nblocks, images);
+        if (crc32c(0, images, (size_t)jh->nblocks * BLOCK_SIZE) != jh->csum)
+        {
+            // the header made it to disk without its record
+            printf("Journal transaction %u is torn, ignoring it\n", jh->seq);
+            if (repair)
+            {
+                jh->committed = 0;
+                bio_write(sb->j_start_blk, jh);
+            }
+        }
+        else if (repair)
+        {
+            for (uint32_t i = 0; i < jh->nblocks; i++)
+                bio_write(jh->blknos[i], images + (size_t)i * BLOCK_SIZE);
+            jh->committed = 0;
+            bio_write(sb->j_start_blk, jh);
+            bio_read(0, sb);
+            printf("Replayed journal transaction %u, %u blocks\n", jh->seq, jh->nblocks);
+        }
+        else
+        {
+            printf("Journal holds committed transaction %u, checking without it\n", jh->seq);
+        }
+        free(images);
+    }
+    free(jh);
+}
+
+
+/*
+ * Step 2: one inode chunk per task. Each valid inode claims its blocks;
+ * pointers outside the data region are cleared.
+ */
+static int check_indirect(struct inode *inode, int slot, int *ptrs) {
+
+    int changed = 0;
+    if (bio_read(inode->indirect_ptr[slot], ptrs) < 0)
+    {
+        problem(1, "Inode %d: indirect block %d failed its checksum", inode->ino, inode->indirect_ptr[slot]);
+        salvage(inode->indirect_ptr[slot], 1, ptrs);
+        changed = 1;
+    }
+    for (int j = 0; j < PTRS_PER_BLOCK; j++)
+    {
+        if (ptrs[j] == 0)
+            continue;
+        if (!ptr_ok(ptrs[j]))
+        {
+            problem(1, "Inode %d: block pointer %d outside the data region", inode->ino, BLK_NUM(ptrs[j]));
+            ptrs[j] = 0;
+            changed = 1;
+            continue;
+        }
+        claim_ptr(ptrs[j]);
+    }
+    if (changed && repair)
+        bio_write_meta(inode->indirect_ptr[slot], ptrs);
+    return changed;
+}
+
+static void *scan_inodes(void *arg) {
+
+    char *chunk = malloc(INODE_CHUNK_BLKS * BLOCK_SIZE);
+    int *ptrs = malloc(BLOCK_SIZE);
+    int c;
+    while ((c = take_task(sb->i_chunks)) != -1)
+    {
+        int first_blk = sb->i_chunk_blk[c];
+        int dirty = 0;
+        if (bio_read_blocks(first_blk, INODE_CHUNK_BLKS, chunk) < 0)
+        {
+            problem(1, "Inode chunk %d failed its checksum", c);
+            salvage(first_blk, INODE_CHUNK_BLKS, chunk);
+            dirty = 1;
+        }
+
+        for (int i = 0; i < INODES_PER_CHUNK; i++)
+        {
+            struct inode *inode = (struct inode *)(chunk + (i / INODES_PER_BLOCK) * BLOCK_SIZE) + i % INODES_PER_BLOCK;
+            int ino = c * INODES_PER_CHUNK + i;
+            if (!inode->valid)
+                continue;
+
+            for (int d = 0; d < DIRECT_PTRS; d++)
+            {
+                if (inode->direct_ptr[d] == -1)
+                    continue;
+                if (!ptr_ok(inode->direct_ptr[d]))
+                {
+                    problem(1, "Inode %d: block pointer %d outside the data region", ino, BLK_NUM(inode->direct_ptr[d]));
+                    inode->direct_ptr[d] = -1;
+                    dirty = 1;
+                    continue;
+                }
+                claim_ptr(inode->direct_ptr[d]);
+            }
+
+            for (int s = 0; s < INDIRECT_PTRS; s++)
+            {
+                if (inode->indirect_ptr[s] == -1)
+                    continue;
+                if (!data_blk(inode->indirect_ptr[s]))
+                {
+                    problem(1, "Inode %d: indirect block %d outside the data region", ino, inode->indirect_ptr[s]);
+                    inode->indirect_ptr[s] = -1;
+                    dirty = 1;
+                    continue;
+                }
+                claim(inode->indirect_ptr[s]);
+                check_indirect(inode, s, ptrs);
+            }
+
+            memcpy(&inodes[ino], inode, sizeof(struct inode));
+        }
+
+        // chunks after the first live in the data region
+        for (int b = 0; b < INODE_CHUNK_BLKS; b++)
+            if (data_blk(first_blk + b))
+                claim(first_blk + b);
+
+        if (dirty && repair)
+            for (int b = 0; b < INODE_CHUNK_BLKS; b++)
+                bio_write_meta(first_blk + b, chunk + b * BLOCK_SIZE);
+    }
+    free(ptrs);
+    free(chunk);
+    return NULL;
+}
+
+
+/*
+ * Step 3: one directory per task. Each entry must name a valid inode;
+ * the ones that do count towards that inode's names.
+ */
+static void check_dir_block(int dir_ino, int blk, struct dirent *block) {
+
+    int changed = 0;
+    if (bio_read(blk, block) < 0)
+    {
+        problem(1, "Directory %d: block %d failed its checksum", dir_ino, blk);
+        salvage(blk, 1, block);
+        changed = 1;
+    }
+    for (int k = 0; k < DIRENTS_PER_BLOCK; k++)
+    {
+        if (!block[k].valid)
+            continue;
+        int ino = block[k].ino;
+        if (ino >= sb->max_inum || !inodes[ino].valid)
+        {
+            problem(1, "Directory %d: entry for missing inode %d", dir_ino, ino);
+            block[k].valid = 0;
+            changed = 1;
+            continue;
+        }
+        __atomic_fetch_add(&names[ino], 1, __ATOMIC_RELAXED);
+    }
+    if (changed && repair)
+        bio_write_meta(blk, block);
+}
+
+// Hand each block of a directory to fn
+static void dir_blocks(int ino, int *ptrs, struct dirent *block, void (*fn)(int, int, struct dirent *)) {
+
+    struct inode *inode = &inodes[ino];
+    for (int d = 0; d < DIRECT_PTRS; d++)
+    {
+        int p = inode->direct_ptr[d];
+        if (p != -1 && !(p & BLK_UNWRITTEN))
+            fn(ino, p, block);
+    }
+    for (int s = 0; s < INDIRECT_PTRS; s++)
+    {
+        if (inode->indirect_ptr[s] == -1)
+            continue;
+        bio_read(inode->indirect_ptr[s], ptrs);
+        for (int j = 0; j < PTRS_PER_BLOCK; j++)
+            if (ptrs[j] != 0 && !(ptrs[j] & BLK_UNWRITTEN))
+                fn(ino, ptrs[j], block);
+    }
+}
+
+static void *scan_dirs(void *arg) {
+
+    struct dirent *block = malloc(BLOCK_SIZE);
+    int *ptrs = malloc(BLOCK_SIZE);
+    int ino;
+    while ((ino = take_task(sb->max_inum)) != -1)
+    {
+        struct inode *inode = &inodes[ino];
+        if (!inode->valid || !S_ISDIR(inode->vstat.st_mode))
+            continue;
+        dir_blocks(ino, ptrs, block, check_dir_block);
+    }
+    free(ptrs);
+    free(block);
+    return NULL;
+}
+
+/*
+ * Step 3b: walk the tree from the root, marking every inode it reaches.
+ * Counting names alone misses a subtree cut off from the root whose
+ * directories name each other. Entries were checked above; a block that
+ * failed its checksum is taken as on disk again without a second report
+ */
+static void reach_dir_block(int dir_ino, int blk, struct dirent *block) {
+
+    if (bio_read(blk, block) < 0)
+        salvage(blk, 1, block);
+    for (int k = 0; k < DIRENTS_PER_BLOCK; k++)
+    {
+        int ino = block[k].ino;
+        if (!block[k].valid || ino >= sb->max_inum || !inodes[ino].valid || reached[ino])
+            continue;
+        reached[ino] = 1;
+        if (S_ISDIR(inodes[ino].vstat.st_mode))
+            pending[n_pending++] = ino;
+    }
+}
+
+static void walk_tree() {
+
+    struct dirent *block = malloc(BLOCK_SIZE);
+    int *ptrs = malloc(BLOCK_SIZE);
+    reached[0] = 1;
+    pending[n_pending++] = 0;
+    while (n_pending > 0)
+        dir_blocks(pending[--n_pending], ptrs, block, reach_dir_block);
+    free(ptrs);
+    free(block);
+}
+
+
+/*
+ * Step 4: the orphan list, then the bitmaps and reference counts against
+ * what steps 2 and 3 found
+ */
+static void check_orphans() {
+
+    int sb_dirty = 0;
+
+    // entries for inodes that are gone
+    for (uint32_t i = 0; i < sb->n_orphans; )
+    {
+        int ino = sb->orphans[i];
+        if (ino >= sb->max_inum || !inodes[ino].valid)
+        {
+            problem(1, "Orphan list: inode %d is not in use", ino);
+            sb->orphans[i] = sb->orphans[--sb->n_orphans];
+            sb_dirty = 1;
+            continue;
+        }
+        i++;
+    }
+
+    // entries for inodes a directory still names: reclaiming them would
+    // free the blocks of a linked file
+    for (uint32_t i = 0; i < sb->n_orphans; )
+    {
+        int ino = sb->orphans[i];
+        if (reached[ino])
+        {
+            problem(1, "Orphan list: inode %d is still in a directory", ino);
+            sb->orphans[i] = sb->orphans[--sb->n_orphans];
+            sb_dirty = 1;
+            continue;
+        }
+        i++;
+    }
+
+    // inodes the root does not reach, other than known orphans
+    for (int ino = 1; ino < sb->max_inum; ino++)
+    {
+        if (!inodes[ino].valid || reached[ino])
+            continue;
+        uint32_t i = 0;
+        while (i < sb->n_orphans && sb->orphans[i] != ino)
+            i++;
+        if (i < sb->n_orphans)
+            continue;
+
+        const char *where = names[ino] > 0 ? "only in directories cut off from the root" : "in no directory";
+        if (sb->n_orphans < ORPHAN_MAX)
+        {
+            problem(1, "Inode %d is %s, %d blocks", ino, where, (int)(inodes[ino].vstat.st_blocks / (BLOCK_SIZE / 512)));
+            sb->orphans[sb->n_orphans++] = ino;
+            sb_dirty = 1;
+        }
+        else
+        {
+            problem(0, "Inode %d is %s and the orphan list is full", ino, where);
+        }
+    }
+
+    if (sb_dirty && repair)
+        bio_write_meta(0, sb);
+}
+
+static void check_bitmaps() {
+
+    bitmap_t on_disk = malloc(BLOCK_SIZE);
+    bitmap_t rebuilt = calloc(1, BLOCK_SIZE);
+    uint16_t *refs = malloc(REFCOUNT_BLKS * BLOCK_SIZE);
+
+    // Step 4a: inode bitmap
+    bio_read(sb->i_bitmap_blk, on_disk);
+    for (int ino = 0; ino < sb->max_inum; ino++)
+    {
+        if (inodes[ino].valid)
+            set_bitmap(rebuilt, ino);
+        if (get_bitmap(rebuilt, ino) != get_bitmap(on_disk, ino))
+            problem(1, inodes[ino].valid ? "Inode %d in use but free in the bitmap" :
+                    "Inode %d marked in use but not valid", ino);
+    }
+    if (repair && memcmp(rebuilt, on_disk, BLOCK_SIZE) != 0)
+        bio_write_meta(sb->i_bitmap_blk, rebuilt);
+
+    // Step 4b: data block bitmap and reference counts
+    memset(rebuilt, 0, BLOCK_SIZE);
+    bio_read(sb->d_bitmap_blk, on_disk);
+    for (int i = 0; i < REFCOUNT_BLKS; i++)
+        bio_read(sb->r_start_blk + i, (char *)refs + (size_t)i * BLOCK_SIZE);
+
+    int refs_dirty = 0;
+    for (int d = 0; d < sb->max_dnum; d++)
+    {
+        int blk = sb->d_start_blk + d;
+        if (owners[d] > 0)
+            set_bitmap(rebuilt, d);
+        if (get_bitmap(rebuilt, d) != get_bitmap(on_disk, d))
+            problem(1, owners[d] > 0 ? "Block %d in use but free in the bitmap" :
+                    "Block %d marked in use but unreferenced", blk);
+
+        uint32_t want = owners[d] > 0 ? owners[d] - 1 : 0;
+        if (want > REFCOUNT_MAX)
+            want = REFCOUNT_MAX;
+        if (refs[d] != want)
+        {
+            problem(1, "Block %d has %d owners beyond the first recorded", blk, refs[d]);
+            refs[d] = want;
+            refs_dirty = 1;
+        }
+    }
+    if (repair && memcmp(rebuilt, on_disk, BLOCK_SIZE) != 0)
+        bio_write_meta(sb->d_bitmap_blk, rebuilt);
+    if (repair && refs_dirty)
+        for (int i = 0; i < REFCOUNT_BLKS; i++)
+            bio_write_meta(sb->r_start_blk + i, (char *)refs + (size_t)i * BLOCK_SIZE);
+
+    free(refs);
+    free(rebuilt);
+    free(on_disk);
+}
+
+
+int main(int argc, char *argv[]) {
+
+    int opt;
+    while ((opt = getopt(argc, argv, "nj:")) != -1)
+    {
+        if (opt == 'n')
+            repair = 0;
+        else if (opt == 'j')
+            nthreads = atoi(optarg);
+        else
+            break;
+    }
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "usage: %s [-n] [-j threads] DISKFILE\n", argv[0]);
+        return 8;
+    }
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > FSCK_MAX_THREADS)
+        nthreads = FSCK_MAX_THREADS;
+
+    if (dev_open(argv[optind]) == -1)
+        return 8;
+
+    sb = malloc(BLOCK_SIZE);
+    bio_read(0, sb);
+    if (sb->magic_num != MAGIC_NUM)
+    {
+        fprintf(stderr, "%s: not a RUFS image of this version\n", argv[optind]);
+        return 8;
+    }
+
+    // Step 1: Journal, then the checksums as of the last commit
+    replay_journal();
+    csum_table = malloc(CSUM_BLKS * BLOCK_SIZE);
+    bio_read_blocks(sb->c_start_blk, CSUM_BLKS, csum_table);
+    bio_csum_attach(csum_table, CSUM_COVER, sb->c_start_blk, sb->d_start_blk, CSUM_VERIFY_META, csum_dirty);
+
+    // Step 2: Inode table, in parallel by chunk
+    inodes = calloc(MAX_INUM, sizeof(struct inode));
+    owners = calloc(sb->max_dnum, sizeof(uint32_t));
+    names = calloc(MAX_INUM, sizeof(uint32_t));
+    run_workers(scan_inodes);
+
+    // Step 3: Directories, in parallel by directory, then the walk from the root
+    run_workers(scan_dirs);
+    reached = calloc(MAX_INUM, 1);
+    pending = malloc(MAX_INUM * sizeof(uint16_t));
+    walk_tree();
+
+    // Step 4: Allocation state
+    check_orphans();
+    check_bitmaps();
+
+    bio_csum_detach();
+    if (repair)
+        for (int i = 0; i < CSUM_BLKS; i++)
+            if (csum_dirty[i])
+                bio_write(sb->c_start_blk + i, (char *)csum_table + (size_t)i * BLOCK_SIZE);
+
+    if (repair && errors > 0)
+        bio_sync();
+    printf("%s: %lu problems, %lu repaired, %d threads\n", argv[optind], errors, fixed, nthreads);
+
+    free(pending);
+    free(reached);
+    free(names);
+    free(owners);
+    free(inodes);
+    free(csum_table);
+    free(sb);
+    dev_close();
+
+    if (errors == 0)
+        return 0;
+    return fixed == errors ? 1 : 4;
+}
@@ -0,0 +1,187 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	lz4.c
+ *
+ *	A small compressor and decompressor for the LZ4 block format: a
+ *	sequence is a token (literal length and match length - 4, 4 bits
+ *	each, 15 meaning more length bytes follow), the literals, a 16 bit
+ *	little-endian offset back into the output and the match. The last
+ *	sequence has literals only. Matches are found through a single-entry
+ *	hash table of 4-byte prefixes, which is what keeps it fast.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+
+#define HASH_BITS	12
+#define MIN_MATCH	4
+#define LAST_LITERALS	5			/* the format ends with at least 5 literals */
+#define MF_LIMIT	12				/* and no match starts in the last 12 bytes */
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int hash32(uint32_t v) {
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Write a length that did not fit in its 4 token bits
+static uint8_t *put_length(uint8_t *op, int len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+// Emit one sequence: literals [anchor, anchor + lit) and, if mlen >= MIN_MATCH,
+// a match of mlen bytes at offset back. Returns the new output position, or
+// NULL if it would pass oend
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *anchor, int lit, int offset, int mlen) {
+    if (op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > oend)
+        return NULL;
+
+    uint8_t *token = op++;
+    *token = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15)
+        op = put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    if (mlen >= MIN_MATCH) {
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        mlen -= MIN_MATCH;
+        *token |= mlen < 15 ? mlen : 15;
+        if (mlen >= 15)
+            op = put_length(op, mlen - 15);
+    }
+    return op;
+}
+
+/*
+ * Compress n bytes (at most LZ4_MAX_INPUT) from src into dst
+ * Returns the compressed size, or 0 if it does not fit in cap bytes
+ */
+int lz4_compress(const void *src, int n, void *dst, int cap) {
+
+    const uint8_t *in = src;
+    const uint8_t *ip = in, *anchor = in;
+    const uint8_t *iend = in + n;
+    uint8_t *op = dst, *oend = op + cap;
+    uint16_t table[1 << HASH_BITS];
+
+    if (n > LZ4_MAX_INPUT)
+        return 0;
+
+    if (n > MF_LIMIT) {
+        memset(table, 0, sizeof(table));
+        const uint8_t *mflimit = iend - MF_LIMIT;
+        const uint8_t *matchlimit = iend - LAST_LITERALS;
+
+        ip++;
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            int h = hash32(seq);
+            const uint8_t *ref = in + table[h];
+            table[h] = ip - in;
+
+            if (ref >= ip || ip - ref > 0xFFFF || read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            // extend the match as far as it goes, then back over literals
+            const uint8_t *m = ip + MIN_MATCH, *r = ref + MIN_MATCH;
+            while (m < matchlimit && *m == *r) {
+                m++;
+                r++;
+            }
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, m - ip);
+            if (op == NULL)
+                return 0;
+            anchor = ip = m;
+        }
+    }
+
+    op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    if (op == NULL)
+        return 0;
+    return op - (uint8_t *)dst;
+}
+
+/*
+ * Decompress clen bytes from src into dst, which has room for n bytes
+ * Returns the decompressed size, or -1 if src is not valid LZ4 or would
+ * write past n bytes
+ */
+int lz4_decompress(const void *src, int clen, void *dst, int n) {
+
+    const uint8_t *ip = src, *iend = ip + clen;
+    uint8_t *out = dst, *op = out, *oend = out + n;
+
+    while (ip < iend) {
+        int token = *ip++;
+
+        int lit = token >> 4;
+        if (lit == 15) {
+            int b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > iend - ip || lit > oend - op)
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        // the last sequence has no match
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op - out)
+            return -1;
+
+        int mlen = token & 15;
+        if (mlen == 15) {
+            int b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += MIN_MATCH;
+        if (mlen > oend - op)
+            return -1;
+
+        // byte by byte: the match may overlap what it is producing
+        const uint8_t *ref = op - offset;
+        while (mlen-- > 0)
+            *op++ = *ref++;
+    }
+
+    return op - out;
+}
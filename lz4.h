@@ -0,0 +1,17 @@
+/*
+ *	Tiny File System
+ *	File:	lz4.h
+ *
+ *	LZ4 block format codec used for compressed clusters (-o compress)
+ *
+ */
+
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+#define LZ4_MAX_INPUT 65536			/* offsets are 16 bits */
+
+int lz4_compress(const void *src, int n, void *dst, int cap);
+int lz4_decompress(const void *src, int clen, void *dst, int n);
+
+#endif
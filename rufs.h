@@ -7,25 +7,41 @@
  */
 
 #include <linux/limits.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "block.h"
+
 #ifndef _TFS_H
 #define _TFS_H
 
-#define MAGIC_NUM 0x5C3A
-#define MAX_INUM 1024
+#define MAGIC_NUM 0x5C3E
+#define MAX_INUM 32768				/* hard limit: one block of inode bitmap */
 #define MAX_DNUM 16384
 
+#define INODES_PER_CHUNK 64			/* inodes added each time the table grows */
+#define MAX_ICHUNKS (MAX_INUM / INODES_PER_CHUNK)
+
+#define ORPHAN_MAX 256				/* unlinked inodes awaiting reclaim */
+
 
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
-	uint16_t	max_inum;			/* maximum inode number */
+	uint16_t	max_inum;			/* current inode capacity (grows by chunks) */
 	uint16_t	max_dnum;			/* maximum data block number */
 	uint32_t	i_bitmap_blk;		/* start block of inode bitmap */
 	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
-	uint32_t	i_start_blk;		/* start block of inode region */
+	uint32_t	i_start_blk;		/* start block of first inode chunk */
 	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	r_start_blk;		/* start block of data block reference counts */
+	uint32_t	j_start_blk;		/* start block of the metadata journal */
+	uint32_t	c_start_blk;		/* start block of the block checksum table */
+	uint32_t	i_chunks;			/* number of inode chunks in use */
+	uint32_t	i_chunk_blk[MAX_ICHUNKS];	/* start block of each inode chunk */
+	uint32_t	n_orphans;			/* unlinked inodes whose blocks are still being freed */
+	uint16_t	orphans[ORPHAN_MAX];
+	uint32_t	mounted;			/* set from mount to clean unmount */
 };
 
 struct inode {
@@ -39,6 +55,79 @@ struct inode {
 	struct stat	vstat;				/* inode stat */
 };
 
+#define DIRECT_PTRS 16
+#define INDIRECT_PTRS 8
+#define PTRS_PER_BLOCK (BLOCK_SIZE / sizeof(int))
+#define MAX_FILE_BLKS (DIRECT_PTRS + INDIRECT_PTRS * PTRS_PER_BLOCK)
+
+/* block pointer flag: reserved by fallocate, never written, reads as zeros */
+#define BLK_UNWRITTEN 0x40000000
+#define BLK_NUM(p) ((p) & 0x001FFFFF)
+
+/*
+ * compressed clusters (-o compress): CZ_BLKS file blocks stored LZ4
+ * compressed in 1 to CZ_BLKS - 1 consecutive blocks, headed by a
+ * cz_header. Each block pointer of the cluster is tagged BLK_COMPRESSED
+ * and carries the extent's first block, its length and the block's place
+ * in the cluster; the first block has one owner per such pointer, the
+ * rest of the extent goes with it.
+ */
+#define CZ_BLKS 4
+#define CZ_MAGIC 0x4C5A3443
+#define BLK_COMPRESSED 0x20000000
+#define BLK_CZ(start, len, idx) (BLK_COMPRESSED | (len) << 26 | (idx) << 24 | (start))
+#define BLK_CZ_LEN(p) (((p) >> 26) & 3)
+#define BLK_CZ_IDX(p) (((p) >> 24) & 3)
+
+struct cz_header {
+	uint32_t	magic;
+	uint32_t	clen;				/* compressed bytes following the header */
+};
+
+/*
+ * packed tails (-o tailpack): a file's last block, when mostly empty, is
+ * kept in TAIL_FRAGS-ths of a block it shares with the tails of other
+ * files. The pointer is tagged BLK_TAIL and carries the first fragment
+ * and the number of fragments; the block has one owner per such pointer.
+ * The rest of the file block reads as zeros.
+ */
+#define TAIL_FRAGS 8
+#define TAIL_FRAG_SIZE (BLOCK_SIZE / TAIL_FRAGS)
+#define BLK_TAIL 0x10000000
+#define BLK_TAIL_PTR(blk, first, n) (BLK_TAIL | (first) << 24 | ((n) - 1) << 21 | (blk))
+#define BLK_TAIL_FIRST(p) (((p) >> 24) & 7)
+#define BLK_TAIL_LEN(p) ((((p) >> 21) & 7) + 1)
+
+/* one uint16_t per data block: owners beyond the first, for shared clones */
+#define REFCOUNT_BLKS ((MAX_DNUM * sizeof(uint16_t) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define REFCOUNT_MAX 0xFFFF
+
+/* CRC32C of every block up to the end of the data region (see block.h) */
+#define CSUM_COVER (MAX_DNUM + 1024)		/* the regions before data fit in 1024 */
+#define CSUM_BLKS CSUM_TABLE_BLKS(CSUM_COVER)
+
+/*
+ * metadata journal: a header block followed by the block images of one
+ * transaction. committed is set once the images are on disk and cleared
+ * once they have been written to their homes.
+ */
+#define JOURNAL_MAGIC 0x4A524E4C
+#define JOURNAL_TXN_MAX 256				/* blocks per transaction */
+#define JOURNAL_BLKS (1 + JOURNAL_TXN_MAX)
+#define JOURNAL_RESERVED (3 + REFCOUNT_BLKS + CSUM_BLKS)	/* superblock, bitmaps, reference counts, checksums */
+
+struct journal_header {
+	uint32_t	magic;
+	uint32_t	committed;
+	uint32_t	seq;				/* transaction number */
+	uint32_t	nblocks;			/* images following the header */
+	uint32_t	blknos[JOURNAL_TXN_MAX];	/* home block of each image */
+	uint32_t	csum;				/* crc32c of the images: a torn record is never replayed */
+};
+
+#define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(struct inode))
+#define INODE_CHUNK_BLKS (INODES_PER_CHUNK / INODES_PER_BLOCK)
+
 struct dirent {
 	uint16_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
@@ -46,6 +135,53 @@ struct dirent {
 	uint16_t len;					/* length of name */
 };
 
+#define DIRENTS_PER_BLOCK (BLOCK_SIZE / sizeof(struct dirent))
+
+
+/*
+ * ioctls understood by a mounted rufs, issued on an open file descriptor
+ */
+#define RUFS_IOC_SEEK_DATA	_IOWR('R', 1, off_t)	/* like lseek(SEEK_DATA) */
+#define RUFS_IOC_SEEK_HOLE	_IOWR('R', 2, off_t)	/* like lseek(SEEK_HOLE) */
+#define RUFS_IOC_CACHE_STATS	_IOR('R', 3, struct bio_stats)	/* block cache and read-ahead counters */
+#define RUFS_IOC_COPY_RANGE	_IOWR('R', 4, struct rufs_copy_range)	/* like copy_file_range(2) into this file */
+#define RUFS_IOC_CLONE		_IOW('R', 5, uint64_t)	/* like FICLONE: share all blocks of the file with this st_ino */
+#define RUFS_IOC_SNAPSHOT	_IOW('R', 6, struct rufs_snapshot)	/* clone a directory tree into this directory */
+#define RUFS_IOC_RENAME		_IOW('R', 7, struct rufs_rename)	/* like renameat2(2), paths from the mount root */
+#define RUFS_IOC_DEDUP_STATS	_IOR('R', 8, struct rufs_dedup_stats)	/* deduplication counters (-o dedup) */
+#define RUFS_IOC_TRACE_LEVEL	_IOW('R', 9, int)	/* set the trace level, TRACE_OFF to TRACE_ALL */
+#define RUFS_IOC_TRACE_DUMP	_IO('R', 10)		/* print the trace ring on the daemon's stdout */
+
+struct rufs_copy_range {
+	uint64_t	src_ino;			/* st_ino of the source file, on the same mount */
+	int64_t		src_off;			/* offset to copy from */
+	int64_t		dst_off;			/* offset in the ioctl's file to copy to */
+	uint64_t	len;				/* in: bytes to copy, out: bytes copied */
+};
+
+struct rufs_dedup_stats {
+	uint64_t	written;			/* file blocks written since mount */
+	uint64_t	shared;				/* of those, stored as a share of an identical block */
+	uint64_t	entries;			/* blocks in the fingerprint index */
+	uint64_t	index_bytes;		/* memory the index takes */
+};
+
+struct rufs_snapshot {
+	uint64_t	src_ino;			/* st_ino of the directory to snapshot */
+	char		name[208];			/* name of the snapshot in the ioctl's directory */
+};
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE	(1 << 0)
+#define RENAME_EXCHANGE		(1 << 1)
+#endif
+
+struct rufs_rename {
+	uint32_t	flags;				/* 0, RENAME_NOREPLACE or RENAME_EXCHANGE */
+	char		from[1024];
+	char		to[1024];
+};
+
 
 /*
  * bitmap operations
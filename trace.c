@@ -0,0 +1,95 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	trace.c
+ *
+ *	A fixed ring of trace events shared by every thread without a lock:
+ *	a writer claims the next position with one atomic add and fills the
+ *	slot it maps to, publishing it by storing the position in the slot's
+ *	seq last. The ring keeps the newest TRACE_RING events; a dump skips
+ *	slots that are being written or were overwritten while it read them.
+ *
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include "trace.h"
+
+struct trace_event {
+    uint64_t seq;				/* position + 1, 0 while being written */
+    uint64_t ns;				/* CLOCK_MONOTONIC */
+    const char *name;			/* function that recorded it */
+    int kind;					/* TRACE_ENTER or TRACE_EXIT */
+    int ino;
+    long blk;
+};
+
+int trace_level = TRACE_OFF;
+
+static struct trace_event trace_ring[TRACE_RING];
+static uint64_t trace_head;		/* positions handed out so far */
+
+static const char *kind_names[] = { "enter", "exit" };
+
+void trace_record(int kind, const char *name, int ino, long blk) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint64_t pos = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    struct trace_event *ev = &trace_ring[pos & (TRACE_RING - 1)];
+
+    __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ev->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    ev->name = name;
+    ev->kind = kind;
+    ev->ino = ino;
+    ev->blk = blk;
+    __atomic_store_n(&ev->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Print the events in the ring, oldest first, with times relative to the
+ * oldest. Safe to call while others are recording
+ */
+void trace_dump(FILE *f) {
+
+    uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TRACE_RING ? head - TRACE_RING : 0;
+    uint64_t base = 0;
+    unsigned long skipped = 0;
+
+    fprintf(f, "Trace: %lu events, showing %lu\n", (unsigned long)head, (unsigned long)(head - first));
+    for (uint64_t pos = first; pos < head; pos++) {
+        struct trace_event *slot = &trace_ring[pos & (TRACE_RING - 1)];
+        struct trace_event ev;
+
+        // copy the slot, then make sure nobody rewrote it meanwhile
+        ev.seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        ev.ns = slot->ns;
+        ev.name = slot->name;
+        ev.kind = slot->kind;
+        ev.ino = slot->ino;
+        ev.blk = slot->blk;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (ev.seq != pos + 1 || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != ev.seq) {
+            skipped++;
+            continue;
+        }
+
+        if (base == 0)
+            base = ev.ns;
+        fprintf(f, "%6lu.%06lu %-5s %-24s", (unsigned long)((ev.ns - base) / 1000000000),
+                (unsigned long)((ev.ns - base) / 1000 % 1000000), kind_names[ev.kind], ev.name);
+        if (ev.ino >= 0)
+            fprintf(f, " ino %d", ev.ino);
+        if (ev.blk >= 0)
+            fprintf(f, " blk %ld", ev.blk);
+        fputc('\n', f);
+    }
+    if (skipped)
+        fprintf(f, "Trace: %lu events changed while dumping\n", skipped);
+    fflush(f);
+}
@@ -0,0 +1,42 @@
+/*
+ *	Tiny File System
+ *	File:	trace.h
+ *
+ *	Event tracing into an in-memory ring buffer, off unless a level is
+ *	set (-o trace=N or RUFS_IOC_TRACE_LEVEL)
+ *
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdio.h>
+
+#define TRACE_OFF	0
+#define TRACE_OPS	1				/* FUSE operations */
+#define TRACE_ALL	2				/* and the internal functions they call */
+
+#define TRACE_RING	4096			/* events kept, a power of two */
+
+#define TRACE_ENTER	0
+#define TRACE_EXIT	1
+
+extern int trace_level;
+
+void trace_record(int kind, const char *name, int ino, long blk);
+void trace_dump(FILE *f);
+
+/*
+ * Record an event if tracing is at level or above; ino and blk are -1
+ * when they do not apply. Disabled, this is one load and a branch
+ */
+#define TRACE(level, kind, ino, blk) \
+	do { \
+		if (__builtin_expect(__atomic_load_n(&trace_level, __ATOMIC_RELAXED) >= (level), 0)) \
+			trace_record(kind, __func__, ino, blk); \
+	} while (0)
+
+#define TRACE_IN(level, ino, blk)	TRACE(level, TRACE_ENTER, ino, blk)
+#define TRACE_OUT(level, ino, blk)	TRACE(level, TRACE_EXIT, ino, blk)
+
+#endif